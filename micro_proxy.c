@@ -27,6 +27,7 @@
 
 /* micro_proxy */
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,6 +36,8 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -46,18 +49,93 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <sys/wait.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+/* response compression */
+#include <zlib.h>
 
 #define SERVER_NAME "micro_proxy"
 #define SERVER_URL "http://www.acme.com/software/micro_proxy/"
 #define PROTOCOL "HTTP/1.0"
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
 #define TIMEOUT 300
+#define MAX_CONNECTIONS 0
+#define DRAIN_TIMEOUT 300
+#define UPGRADE_TIMEOUT 30
+
+/* Response compression.  Only responses whose media type matches one of
+** GZIP_TYPES (space separated, an entry ending in a star matches a whole
+** type) and that are at least GZIP_MIN_LENGTH bytes long, when the length
+** is known, get compressed.  An empty type list turns compression off.
+** The default spells out the text types so that text/event-stream isn't
+** among them.
+*/
+#define GZIP_TYPES "text/html text/plain text/css text/xml text/javascript text/csv application/json application/javascript application/xml image/svg+xml"
+#define GZIP_MIN_LENGTH 1024
+#define GZIP_LEVEL 1
+/* How long, in milliseconds, the origin has to go quiet before we flush
+** what has been compressed so far.
+*/
+#define GZIP_FLUSH_WAIT 5
+
+#define CODING_IDENTITY 0
+#define CODING_GZIP 1
+#define CODING_DEFLATE 2
+
+/* Settings from the config file.  A reload replaces the whole struct;
+** each request works from its own copy, taken when it starts.
+*/
+struct config {
+    int port;
+    int timeout;
+    int max_connections;
+    int drain_timeout;
+    char gzip_types[1000];
+    long gzip_min_length;
+    int gzip_level;
+};
+
+static struct config config;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* config_file = (char*) 0;
+
+/* Requests in flight, so a retiring process knows when it's done. */
+static int active_connections = 0;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t active_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+
+/* Our own command line, minus any -u, for re-executing on upgrade. */
+static char** exec_args;
+
+/* The port given on the command line, which beats the config file. */
+static char* port_arg = (char*) 0;
 
 /* Forwards. */
 static int open_client_socket( int client, char* hostname, unsigned short port );
-static void proxy_http( int client, char* method, char* path, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp );
-static void proxy_ssl( int client, char* method, char* host, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp );
+static void handle_request( int client, struct config* conf );
+static void proxy_http( int client, char* method, char* path, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp, struct config* conf );
+static void proxy_ssl( int client, char* method, char* host, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp, struct config* conf );
+static int accepts_coding( char* value, char* coding );
+static int lists_token( char* value, char* token );
+static int compressible_type( char* content_type, char* types );
+static void proxy_compress( int client, FILE* sockrfp, long content_length, z_stream* zs, int chunked, int timeout );
+static int send_chunk( int client, unsigned char* data, unsigned int len );
 static void sigcatch( int sig );
+static void sigflag( int sig );
+static void default_config( struct config* conf );
+static int read_config( char* filename, struct config* conf );
+static int config_number( char* filename, int lineno, char* name, char* value, long min, long max, long* result );
+static void get_config( struct config* conf );
+static void reload_config( void );
+static int upgrade( int server_sock );
+static void drain( int drain_timeout );
+static int send_fd( int sock, int fd );
+static int recv_fd( int sock );
+static void usage( char* argv0 );
 static void trim( char* line );
 static void send_error( int client, int status, char* title, char* extra_header, char* text );
 static void send_headers( int client, int status, char* title, char* extra_header, char* mime_type, int length, time_t mod );
@@ -186,11 +264,16 @@ ok:
 
 #endif /* USE_IPV6 */
 
+    /* Don't let an upgrade's exec inherit this. */
+#ifdef SOCK_CLOEXEC
+    sock_type |= SOCK_CLOEXEC;
+#endif /* SOCK_CLOEXEC */
     sockfd = socket( sock_family, sock_type, sock_protocol );
     if ( sockfd < 0 ) {
         send_error( client, 500, "Internal Error", (char*) 0, "Couldn't create socket." );
         return -1;
     }
+    (void) fcntl( sockfd, F_SETFD, FD_CLOEXEC );
 
     if ( connect( sockfd, (struct sockaddr*) &sa_in, sa_len ) < 0 ) {
         send_error( client, 503, "Service Unavailable", (char*) 0, "Connection refused." );
@@ -202,22 +285,31 @@ ok:
 
 
 static void
-proxy_http( int client, char* method, char* path, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp )
+proxy_http( int client, char* method, char* path, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp, struct config* conf )
 {
     char line[10000], protocol2[10000], comment[10000];
+    char content_length_line[10000], content_type[10000], etag[10000];
+    char encoding_line[100];
     const char *connection_close = "Connection: close\r\n";
+    const char *transfer_chunked = "Transfer-Encoding: chunked\r\n";
+    const char *vary = "Vary: Accept-Encoding\r\n";
     int first_line, status, ich;
+    int client_coding, coding, chunked, has_range, encoded, compressible;
+    int no_transform, origin_vary;
     long content_length, i;
     char* headerLine = headers;
+    z_stream zs;
 
     /* Send request. */
-    (void) alarm( TIMEOUT );
+    (void) alarm( conf->timeout );
     (void) fprintf( sockwfp, "%s %s %s\r\n", method, path, protocol );
     /* Forward the remainder of the request from the client. */
     fputs( headers, sockwfp );
     (void) fflush( sockwfp );
 
     content_length = -1;
+    client_coding = CODING_IDENTITY;
+    has_range = 0;
     while ( headerLine )
     {
         char* nextLine = strchr(headerLine, '\n');
@@ -227,6 +319,16 @@ proxy_http( int client, char* method, char* path, char* protocol, char* headers,
             trim( headerLine );
             content_length = atol( &(headerLine[15]) );
         }
+        else if ( strncasecmp( headerLine, "Accept-Encoding:", 16 ) == 0 )
+        {
+            trim( headerLine );
+            if ( accepts_coding( &(headerLine[16]), "gzip" ) )
+                client_coding = CODING_GZIP;
+            else if ( accepts_coding( &(headerLine[16]), "deflate" ) )
+                client_coding = CODING_DEFLATE;
+        }
+        else if ( strncasecmp( headerLine, "Range:", 6 ) == 0 )
+            has_range = 1;
         headerLine = nextLine ? (nextLine + 1) : NULL;
     }
 
@@ -236,17 +338,30 @@ proxy_http( int client, char* method, char* path, char* protocol, char* headers,
             fputc( ich, sockwfp );
     (void) fflush( sockwfp );
 
-    /* Forward the response back to the client. */
-    (void) alarm( TIMEOUT );
+    /* Forward the response back to the client.  Content-Length and ETag
+    ** are held back until we know whether the body is going to be
+    ** compressed.
+    */
+    (void) alarm( conf->timeout );
     content_length = -1;
     first_line = 1;
     status = -1;
+    encoded = 0;
+    no_transform = 0;
+    origin_vary = 0;
+    protocol2[0] = '\0';
+    content_length_line[0] = '\0';
+    content_type[0] = '\0';
+    etag[0] = '\0';
     while ( fgets( line, sizeof(line), sockrfp ) != (char*) 0 )
     {
         if ( strcmp( line, "\n" ) == 0 || strcmp( line, "\r\n" ) == 0 )
             break;
-        (void) send(client, line, strlen(line), 0);
-        (void) alarm( TIMEOUT );
+        if ( strncasecmp( line, "Content-Length:", 15 ) == 0 )
+            (void) strcpy( content_length_line, line );
+        else if ( strncasecmp( line, "ETag:", 5 ) != 0 )
+            (void) send(client, line, strlen(line), 0);
+        (void) alarm( conf->timeout );
         trim( line );
         if ( first_line )
         {
@@ -255,10 +370,71 @@ proxy_http( int client, char* method, char* path, char* protocol, char* headers,
         }
         if ( strncasecmp( line, "Content-Length:", 15 ) == 0 )
             content_length = atol( &(line[15]) );
+        else if ( strncasecmp( line, "Content-Type:", 13 ) == 0 )
+            (void) strcpy( content_type, &(line[13]) );
+        else if ( strncasecmp( line, "ETag:", 5 ) == 0 )
+            (void) strcpy( etag, &(line[5 + strspn( &(line[5]), " \t" )]) );
+        else if ( strncasecmp( line, "Content-Encoding:", 17 ) == 0 ||
+                  strncasecmp( line, "Transfer-Encoding:", 18 ) == 0 )
+            encoded = 1;
+        else if ( strncasecmp( line, "Cache-Control:", 14 ) == 0 &&
+                  lists_token( &(line[14]), "no-transform" ) )
+            no_transform = 1;
+        else if ( strncasecmp( line, "Vary:", 5 ) == 0 &&
+                  ( lists_token( &(line[5]), "Accept-Encoding" ) || lists_token( &(line[5]), "*" ) ) )
+            origin_vary = 1;
+    }
+
+    /* Decide whether to compress.  We leave alone anything already
+    ** encoded, anything marked no-transform, partial content, and bodies
+    ** too small to be worth it.
+    ** The compressed body is chunked when both ends speak HTTP/1.1,
+    ** otherwise it just runs until we close the connection.
+    */
+    coding = CODING_IDENTITY;
+    chunked = strcmp( protocol, "HTTP/1.1" ) == 0 && strcmp( protocol2, "HTTP/1.1" ) == 0;
+    compressible = compressible_type( content_type, conf->gzip_types );
+    if ( client_coding != CODING_IDENTITY && status == 200 && ! has_range && ! encoded && ! no_transform &&
+         strcasecmp( method, "HEAD" ) != 0 &&
+         ( content_length == -1 || content_length >= conf->gzip_min_length ) &&
+         compressible )
+    {
+        (void) memset( (void*) &zs, 0, sizeof(zs) );
+        if ( deflateInit2( &zs, conf->gzip_level, Z_DEFLATED, client_coding == CODING_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY ) == Z_OK )
+            coding = client_coding;
     }
-    /* Add a response header. */
+
+    /* Add response headers.  A compressed body is different bytes, so a
+    ** strong ETag only survives as a weak one.  Vary goes on every
+    ** response of a compressible type, so caches keep both variants,
+    ** unless the origin's own Vary already covers it.
+    */
+    if ( coding != CODING_IDENTITY )
+    {
+        (void) snprintf( encoding_line, sizeof(encoding_line), "Content-Encoding: %s\r\n", coding == CODING_GZIP ? "gzip" : "deflate" );
+        (void) send(client, encoding_line, strlen(encoding_line), 0);
+        if ( chunked )
+            (void) send(client, transfer_chunked, strlen(transfer_chunked), 0);
+    }
+    else if ( content_length_line[0] != '\0' )
+        (void) send(client, content_length_line, strlen(content_length_line), 0);
+    if ( etag[0] != '\0' )
+    {
+        (void) snprintf( line, sizeof(line), "ETag: %s%s\r\n",
+            coding != CODING_IDENTITY && strncmp( etag, "W/", 2 ) != 0 ? "W/" : "", etag );
+        (void) send(client, line, strlen(line), 0);
+    }
+    if ( compressible && ! origin_vary )
+        (void) send(client, vary, strlen(vary), 0);
     send(client, connection_close, strlen(connection_close), 0);
-    (void) send(client, line, strlen(line), 0);
+    (void) send(client, "\r\n", 2, 0);
+
+    if ( coding != CODING_IDENTITY )
+    {
+        proxy_compress( client, sockrfp, content_length, &zs, chunked, conf->timeout );
+        return;
+    }
+
     /* Under certain circumstances we don't look for the contents, even
     ** if there was a Content-Length.
     */
@@ -271,14 +447,236 @@ proxy_http( int client, char* method, char* path, char* protocol, char* headers,
         {
             send(client, &ich, 1, 0);
             if ( i % 10000 == 0 )
-                (void) alarm( TIMEOUT );
+                (void) alarm( conf->timeout );
+        }
+    }
+}
+
+
+/* Check whether an Accept-Encoding value allows the given coding, i.e.
+** lists it without a q-value of zero.  "*" only counts when the coding
+** isn't listed by name.
+*/
+static int
+accepts_coding( char* value, char* coding )
+{
+    char* cp = value;
+    char* q;
+    size_t len;
+    int ok, star;
+
+    star = 0;
+    while ( *cp != '\0' )
+    {
+        cp += strspn( cp, " \t," );
+        len = strcspn( cp, " \t;," );
+
+        /* Look for a q-value of zero before the next comma. */
+        ok = 1;
+        for ( q = cp + len; *q != '\0' && *q != ','; ++q )
+            if ( ( *q == 'q' || *q == 'Q' ) && q[1] == '=' )
+            {
+                ok = atof( &q[2] ) > 0.0;
+                break;
+            }
+
+        if ( len == strlen( coding ) && strncasecmp( cp, coding, len ) == 0 )
+            return ok;
+        if ( len == 1 && *cp == '*' )
+            star = ok;
+        cp += len;
+        cp += strcspn( cp, "," );
+    }
+    return star;
+}
+
+
+/* Check whether a comma separated header value, such as Cache-Control
+** or Vary, has the given token as one of its elements.
+*/
+static int
+lists_token( char* value, char* token )
+{
+    char* cp = value;
+    size_t len;
+
+    while ( *cp != '\0' )
+    {
+        cp += strspn( cp, " \t," );
+        len = strcspn( cp, " \t;=," );
+        if ( len > 0 && len == strlen( token ) && strncasecmp( cp, token, len ) == 0 )
+            return 1;
+        cp += len;
+        cp += strcspn( cp, "," );
+    }
+    return 0;
+}
+
+
+/* Check whether a Content-Type value matches a gzip_types list. */
+static int
+compressible_type( char* content_type, char* types )
+{
+    char* type = content_type;
+    char* cp;
+    size_t type_len, len;
+
+    type += strspn( type, " \t" );
+    type_len = strcspn( type, " \t;" );
+    if ( type_len == 0 )
+        return 0;
+
+    for ( cp = types; *cp != '\0'; cp += len )
+    {
+        cp += strspn( cp, " \t," );
+        len = strcspn( cp, " \t," );
+        if ( len == 0 )
+            break;
+        if ( len > 2 && cp[len - 1] == '*' && cp[len - 2] == '/' )
+        {
+            if ( type_len > len - 1 && strncasecmp( type, cp, len - 1 ) == 0 )
+                return 1;
+        }
+        else if ( len == type_len && strncasecmp( type, cp, len ) == 0 )
+            return 1;
+    }
+    return 0;
+}
+
+
+/* Compress the response body as it arrives and send it out, as chunks
+** if asked to.  Whatever stdio already buffered goes first, then we take
+** what the socket has as it comes.  The compressor is only flushed when
+** the origin goes quiet for GZIP_FLUSH_WAIT, so slow responses aren't
+** held up here but a steady stream still compresses as one.
+*/
+static void
+proxy_compress( int client, FILE* sockrfp, long content_length, z_stream* zs, int chunked, int timeout )
+{
+    unsigned char in[16384], out[16384];
+    size_t want, n;
+    ssize_t r;
+    long total;
+    int fd, flags, buffered, eof, flush;
+    struct pollfd pfd;
+
+    fd = fileno( sockrfp );
+    flags = fcntl( fd, F_GETFL );
+    (void) fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+    buffered = 1;
+    total = 0;
+    eof = 0;
+    for (;;)
+    {
+        want = sizeof(in);
+        if ( content_length != -1 && (long) want > content_length - total )
+            want = (size_t) ( content_length - total );
+        if ( want == 0 )
+            n = 0;
+        else if ( buffered )
+        {
+            /* With the socket non-blocking, this stops once stdio's
+            ** buffer and the socket are both empty.
+            */
+            n = fread( in, 1, want, sockrfp );
+            if ( n < want )
+            {
+                if ( feof( sockrfp ) )
+                    eof = 1;
+                else if ( errno != EAGAIN && errno != EWOULDBLOCK )
+                    goto done;
+                clearerr( sockrfp );
+                (void) fcntl( fd, F_SETFL, flags );
+                buffered = 0;
+                if ( n == 0 && ! eof )
+                    continue;
+            }
+        }
+        else
+        {
+            r = read( fd, in, want );
+            if ( r < 0 && errno == EINTR )
+                continue;
+            if ( r < 0 )
+                goto done;
+            if ( r == 0 )
+                eof = 1;
+            n = (size_t) r;
+        }
+        total += (long) n;
+        if ( content_length != -1 && total >= content_length )
+            eof = 1;
+
+        /* If the origin quits early, leave the stream unfinished so the
+        ** client can tell the body is short.
+        */
+        if ( eof && content_length != -1 && total < content_length )
+            goto done;
+
+        if ( eof )
+            flush = Z_FINISH;
+        else
+        {
+            /* A short read often just means the next segment is still on
+            ** its way; only flush if nothing turns up.
+            */
+            flush = Z_NO_FLUSH;
+            if ( n < want )
+            {
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                if ( poll( &pfd, 1, GZIP_FLUSH_WAIT ) == 0 )
+                    flush = Z_SYNC_FLUSH;
+            }
         }
+        zs->next_in = in;
+        zs->avail_in = (uInt) n;
+        do
+        {
+            zs->next_out = out;
+            zs->avail_out = sizeof(out);
+            (void) deflate( zs, flush );
+            n = sizeof(out) - zs->avail_out;
+            if ( n > 0 && ( chunked ?
+                    send_chunk( client, out, (unsigned int) n ) :
+                    send(client, out, n, 0) ) < 0 )
+                goto done;
+        }
+        while ( zs->avail_out == 0 );
+        (void) alarm( timeout );
+        if ( eof )
+            break;
     }
+
+    /* Last chunk. */
+    if ( chunked )
+        (void) send(client, "0\r\n\r\n", 5, 0);
+
+done:
+    if ( buffered )
+        (void) fcntl( fd, F_SETFL, flags );
+    (void) deflateEnd( zs );
+}
+
+
+/* Send one piece of a chunked body. */
+static int
+send_chunk( int client, unsigned char* data, unsigned int len )
+{
+    char buf[16384 + 20];
+    int hlen;
+
+    if ( len > sizeof(buf) - 20 )
+        return -1;
+    hlen = snprintf( buf, sizeof(buf), "%x\r\n", len );
+    (void) memcpy( &buf[hlen], data, len );
+    (void) memcpy( &buf[hlen + len], "\r\n", 2 );
+    return send(client, buf, hlen + len + 2, 0) < 0 ? -1 : 0;
 }
 
 
 static void
-proxy_ssl( int client, char* method, char* host, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp )
+proxy_ssl( int client, char* method, char* host, char* protocol, char* headers, FILE* sockrfp, FILE* sockwfp, struct config* conf )
 {
     int client_read_fd, server_read_fd, client_write_fd, server_write_fd;
     struct timeval timeout;
@@ -294,7 +692,7 @@ proxy_ssl( int client, char* method, char* host, char* protocol, char* headers,
     server_read_fd = fileno( sockrfp );
     client_write_fd = client;
     server_write_fd = fileno( sockwfp );
-    timeout.tv_sec = TIMEOUT;
+    timeout.tv_sec = conf->timeout;
     timeout.tv_usec = 0;
     if ( client_read_fd >= server_read_fd )
         maxp1 = client_read_fd + 1;
@@ -341,6 +739,365 @@ sigcatch( int sig )
 }
 
 
+/* SIGHUP asks for a config reload, SIGUSR2 for a binary upgrade.  The
+** real work happens in the main loop, which sees pselect() interrupted.
+*/
+static void
+sigflag( int sig )
+{
+    if ( sig == SIGHUP )
+        reload_requested = 1;
+    else if ( sig == SIGUSR2 )
+        upgrade_requested = 1;
+}
+
+
+static void
+default_config( struct config* conf )
+{
+    (void) memset( (void*) conf, 0, sizeof(*conf) );
+    conf->port = 0;
+    conf->timeout = TIMEOUT;
+    conf->max_connections = MAX_CONNECTIONS;
+    conf->drain_timeout = DRAIN_TIMEOUT;
+    (void) snprintf( conf->gzip_types, sizeof(conf->gzip_types), "%s", GZIP_TYPES );
+    conf->gzip_min_length = GZIP_MIN_LENGTH;
+    conf->gzip_level = GZIP_LEVEL;
+}
+
+
+/* Read a config file of "name value" lines on top of conf.  Blank lines
+** and anything after a '#' are ignored.  Returns -1 on any error, in
+** which case conf may be partly updated.
+*/
+static int
+read_config( char* filename, struct config* conf )
+{
+    FILE* fp;
+    char line[10000], name[10000], value[10000];
+    char* cp;
+    int lineno, r;
+    long n;
+
+    fp = fopen( filename, "r" );
+    if ( fp == (FILE*) 0 )
+    {
+        perror( filename );
+        return -1;
+    }
+    lineno = 0;
+    while ( fgets( line, sizeof(line), fp ) != (char*) 0 )
+    {
+        ++lineno;
+        if ( ( cp = strchr( line, '#' ) ) != (char*) 0 )
+            *cp = '\0';
+        value[0] = '\0';
+        if ( sscanf( line, " %s %[^\r\n]", name, value ) < 1 )
+            continue;
+        if ( strcasecmp( name, "gzip_types" ) == 0 )
+        {
+            if ( snprintf( conf->gzip_types, sizeof(conf->gzip_types), "%s", value ) >= (int) sizeof(conf->gzip_types) )
+            {
+                (void) fprintf( stderr, "%s:%d - gzip_types is too long\n", filename, lineno );
+                (void) fclose( fp );
+                return -1;
+            }
+            continue;
+        }
+        if ( strcasecmp( name, "port" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 0, 65535, &n );
+            conf->port = (int) n;
+        }
+        else if ( strcasecmp( name, "timeout" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 1, INT_MAX, &n );
+            conf->timeout = (int) n;
+        }
+        else if ( strcasecmp( name, "max_connections" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 0, INT_MAX, &n );
+            conf->max_connections = (int) n;
+        }
+        else if ( strcasecmp( name, "drain_timeout" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 0, INT_MAX, &n );
+            conf->drain_timeout = (int) n;
+        }
+        else if ( strcasecmp( name, "gzip_min_length" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 0, LONG_MAX, &n );
+            conf->gzip_min_length = n;
+        }
+        else if ( strcasecmp( name, "gzip_level" ) == 0 )
+        {
+            r = config_number( filename, lineno, name, value, 1, 9, &n );
+            conf->gzip_level = (int) n;
+        }
+        else
+        {
+            (void) fprintf( stderr, "%s:%d - unknown setting \"%s\"\n", filename, lineno, name );
+            r = -1;
+        }
+        if ( r < 0 )
+        {
+            (void) fclose( fp );
+            return -1;
+        }
+    }
+    (void) fclose( fp );
+    return 0;
+}
+
+
+/* Parse a whole-number setting and check it's within [min, max]. */
+static int
+config_number( char* filename, int lineno, char* name, char* value, long min, long max, long* result )
+{
+    char* end;
+
+    errno = 0;
+    *result = strtol( value, &end, 10 );
+    while ( *end == ' ' || *end == '\t' )
+        ++end;
+    if ( end == value || *end != '\0' || errno == ERANGE || *result < min || *result > max )
+    {
+        (void) fprintf( stderr, "%s:%d - %s must be a number from %ld to %ld\n", filename, lineno, name, min, max );
+        return -1;
+    }
+    return 0;
+}
+
+
+static void
+get_config( struct config* conf )
+{
+    (void) pthread_mutex_lock( &config_lock );
+    *conf = config;
+    (void) pthread_mutex_unlock( &config_lock );
+}
+
+
+/* Re-read the config file.  Requests already running keep the settings
+** they started with.  The listening socket stays as it is, so a new port
+** only takes effect after a full restart; neither this nor an upgrade
+** will move it.
+*/
+static void
+reload_config( void )
+{
+    struct config conf;
+
+    if ( config_file == (char*) 0 )
+        return;
+    default_config( &conf );
+    if ( read_config( config_file, &conf ) < 0 )
+    {
+        (void) fprintf( stderr, "%s - reload failed, keeping the old settings\n", config_file );
+        return;
+    }
+    if ( port_arg != (char*) 0 )
+        conf.port = atoi( port_arg );
+    if ( conf.port != 0 && conf.port != config.port )
+        (void) fprintf( stderr, "%s - port %d ignored, still listening on %d; changing the port needs a restart\n", config_file, conf.port, config.port );
+    conf.port = config.port;
+    (void) pthread_mutex_lock( &config_lock );
+    config = conf;
+    (void) pthread_mutex_unlock( &config_lock );
+    (void) fprintf( stderr, "%s - reloaded\n", config_file );
+}
+
+
+/* Start a fresh copy of ourselves and hand it the listening socket over
+** a Unix socket.  Returns 0 once the new process says it's accepting,
+** -1 if anything went wrong and we should carry on as before.
+*/
+static int
+upgrade( int server_sock )
+{
+    int sv[2];
+    int argc, i, r;
+    char fdstr[20];
+    char** args;
+    char c;
+    pid_t pid;
+    struct pollfd pfd;
+    time_t deadline, left;
+
+    for ( argc = 0; exec_args[argc] != (char*) 0; ++argc )
+        continue;
+    args = (char**) malloc( ( argc + 3 ) * sizeof(char*) );
+    if ( args == (char**) 0 )
+    {
+        perror( "malloc" );
+        return -1;
+    }
+    if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+    {
+        perror( "socketpair" );
+        free( args );
+        return -1;
+    }
+    (void) fcntl( sv[0], F_SETFD, FD_CLOEXEC );
+    (void) snprintf( fdstr, sizeof(fdstr), "%d", sv[1] );
+    args[0] = exec_args[0];
+    args[1] = "-u";
+    args[2] = fdstr;
+    for ( i = 1; i <= argc; ++i )
+        args[i + 2] = exec_args[i];
+
+    pid = fork();
+    if ( pid < 0 )
+    {
+        perror( "fork" );
+        (void) close( sv[0] );
+        (void) close( sv[1] );
+        free( args );
+        return -1;
+    }
+    if ( pid == 0 )
+    {
+        (void) execvp( args[0], args );
+        perror( args[0] );
+        _exit( 1 );
+    }
+    (void) close( sv[1] );
+    free( args );
+
+    /* Pass the socket, then wait a bounded time for the go-ahead; we
+    ** aren't accepting meanwhile.  If the new binary dies instead, its
+    ** end closes and the read comes back empty.
+    */
+    r = -1;
+    if ( send_fd( sv[0], server_sock ) == 0 )
+    {
+        pfd.fd = sv[0];
+        pfd.events = POLLIN;
+        deadline = time( (time_t*) 0 ) + UPGRADE_TIMEOUT;
+        while ( ( left = deadline - time( (time_t*) 0 ) ) > 0 )
+        {
+            r = poll( &pfd, 1, (int) left * 1000 );
+            if ( r < 0 && errno == EINTR )
+                continue;
+            if ( r > 0 )
+                r = read( sv[0], &c, 1 );
+            break;
+        }
+    }
+    (void) close( sv[0] );
+    if ( r != 1 )
+    {
+        (void) fprintf( stderr, "upgrade failed, keeping the old process\n" );
+        (void) kill( pid, SIGTERM );
+        (void) waitpid( pid, (int*) 0, 0 );
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Wait for the requests still in flight to finish, or for drain_timeout
+** seconds if that's non-zero.
+*/
+static void
+drain( int drain_timeout )
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = time( (time_t*) 0 ) + drain_timeout;
+    deadline.tv_nsec = 0;
+    (void) pthread_mutex_lock( &active_lock );
+    while ( active_connections > 0 )
+    {
+        if ( drain_timeout <= 0 )
+            (void) pthread_cond_wait( &active_cond, &active_lock );
+        else if ( pthread_cond_timedwait( &active_cond, &active_lock, &deadline ) == ETIMEDOUT )
+        {
+            (void) fprintf( stderr, "drain timed out with %d connections open\n", active_connections );
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock( &active_lock );
+}
+
+
+/* Send a file descriptor over a Unix socket, as SCM_RIGHTS ancillary
+** data riding on a single byte.
+*/
+static int
+send_fd( int sock, int fd )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char c = 'F';
+
+    (void) memset( (void*) &msg, 0, sizeof(msg) );
+    (void) memset( (void*) &control, 0, sizeof(control) );
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof(int) );
+    (void) memmove( CMSG_DATA( cmsg ), &fd, sizeof(int) );
+    if ( sendmsg( sock, &msg, 0 ) != 1 )
+    {
+        perror( "sendmsg" );
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Receive a file descriptor sent by send_fd(). */
+static int
+recv_fd( int sock )
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char c;
+    int fd;
+
+    (void) memset( (void*) &msg, 0, sizeof(msg) );
+    iov.iov_base = &c;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if ( recvmsg( sock, &msg, 0 ) != 1 )
+        return -1;
+    cmsg = CMSG_FIRSTHDR( &msg );
+    if ( cmsg == (struct cmsghdr*) 0 || cmsg->cmsg_level != SOL_SOCKET ||
+         cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN( sizeof(int) ) )
+        return -1;
+    (void) memmove( &fd, CMSG_DATA( cmsg ), sizeof(int) );
+    return fd;
+}
+
+
+static void
+usage( char* argv0 )
+{
+    (void) fprintf( stderr, "usage:  %s [-c configfile] [port]\n", argv0 );
+    exit( 1 );
+}
+
+
 static void
 trim( char* line )
 {
@@ -429,6 +1186,22 @@ send_headers( int client, int status, char* title, char* extra_header, char* mim
 void *accept_request(void *_client)
 {
     int client = (int) (long) _client;
+    struct config conf;
+
+    get_config( &conf );
+    handle_request( client, &conf );
+    close(client);
+
+    (void) pthread_mutex_lock( &active_lock );
+    --active_connections;
+    (void) pthread_cond_signal( &active_cond );
+    (void) pthread_mutex_unlock( &active_lock );
+    return NULL;
+}
+
+static void
+handle_request( int client, struct config* conf )
+{
     int numchars;
 
     char line[10000], method[10000], url[10000], protocol[10000], host[10000], path[10000], headers[20000];
@@ -444,19 +1217,19 @@ void *accept_request(void *_client)
     /* Read the first line of the request. */
     if ( numchars == 0 ) {
         send_error( client, 400, "Bad Request", (char*) 0, "No request found." );
-        return NULL;
+        return;
     }
 
     /* Parse it. */
     trim( line );
     if ( sscanf( line, "%[^ ] %[^ ] %[^ ]", method, url, protocol ) != 3 ) {
         send_error( client, 400, "Bad Request", (char*) 0, "Can't parse request." );
-        return NULL;
+        return;
     }
 
     if ( url[0] == '\0' ) {
         send_error( client, 400, "Bad Request", (char*) 0, "Null URL." );
-        return NULL;
+        return;
     }
 
     if ( strncasecmp( url, "http://", 7 ) == 0 )
@@ -478,7 +1251,7 @@ void *accept_request(void *_client)
         }
         else {
             send_error( client, 400, "Bad Request", (char*) 0, "Can't parse URL." );
-            return NULL;
+            return;
         }
         ssl = 0;
     }
@@ -490,24 +1263,24 @@ void *accept_request(void *_client)
             port = 443;
         else {
             send_error( client, 400, "Bad Request", (char*) 0, "Can't parse URL." );
-            return NULL;
+            return;
         }
         ssl = 1;
     }
     else {
         send_error( client, 400, "Bad Request", (char*) 0, "Unknown URL type." );
-        return NULL;
+        return;
     }
 
     /* Get ready to catch timeouts.. */
     (void) signal( SIGALRM, sigcatch );
 
     /* Read headers */
-    (void) alarm( TIMEOUT );
+    (void) alarm( conf->timeout );
     while ( get_line(client, line, sizeof(line)) > 0 )
     {
         int line_len = strlen(line);
-        (void) alarm( TIMEOUT );
+        (void) alarm( conf->timeout );
         memcpy(&headers[headers_len], line, line_len);
         headers_len += line_len;
         if ( strcmp( line, "\n" ) == 0 || strcmp( line, "\r\n" ) == 0 )
@@ -516,7 +1289,7 @@ void *accept_request(void *_client)
     headers[headers_len] = '\0';
 
     /* Open the client socket to the real web server. */
-    (void) alarm( TIMEOUT );
+    (void) alarm( conf->timeout );
     sockfd = open_client_socket( client, host, port );
 
     if (sockfd >= 0) {
@@ -525,16 +1298,13 @@ void *accept_request(void *_client)
         sockwfp = fdopen( sockfd, "w" );
 
         if ( ssl )
-            proxy_ssl( client, method, host, protocol, headers, sockrfp, sockwfp );
+            proxy_ssl( client, method, host, protocol, headers, sockrfp, sockwfp, conf );
         else
-            proxy_http( client, method, path, protocol, headers, sockrfp, sockwfp );
+            proxy_http( client, method, path, protocol, headers, sockrfp, sockwfp, conf );
 
         /* Done. */
         (void) close( sockfd );
     }
-
-    close(client);
-    return NULL;
 }
 
 /**********************************************************************/
@@ -642,7 +1412,7 @@ int startup(u_short *port)
             error_die("getsockname");
         *port = ntohs(name.sin_port);
     }
-    if (listen(httpd, 5) < 0)
+    if (listen(httpd, SOMAXCONN) < 0)
         error_die("listen");
     return(httpd);
 }
@@ -650,7 +1420,7 @@ int startup(u_short *port)
 /**********************************************************************/
 
 
-int main(int argc, const char **argv)
+int main(int argc, char **argv)
 {
     int server_sock = -1;
     u_short port = 0;
@@ -658,28 +1428,152 @@ int main(int argc, const char **argv)
     struct sockaddr_in client_name;
     unsigned int client_name_len = (unsigned int) sizeof(client_name);
     pthread_t newthread;
+    struct sigaction sa;
+    sigset_t sigs, waitsigs;
+    fd_set fdset;
+    int flags;
+    int argn, nargs;
+    int upgrade_fd = -1;
+
+    /* Parse args, remembering them (without -u) for a later upgrade. */
+    exec_args = (char**) malloc( ( argc + 1 ) * sizeof(char*) );
+    if ( exec_args == (char**) 0 )
+        error_die("malloc");
+    exec_args[0] = argv[0];
+    nargs = 1;
+    for ( argn = 1; argn < argc; ++argn )
+    {
+        if ( strcmp( argv[argn], "-c" ) == 0 && argn + 1 < argc )
+        {
+            config_file = argv[argn + 1];
+            exec_args[nargs++] = argv[argn++];
+            exec_args[nargs++] = argv[argn];
+        }
+        else if ( strcmp( argv[argn], "-u" ) == 0 && argn + 1 < argc )
+            upgrade_fd = atoi( argv[++argn] );
+        else if ( argv[argn][0] != '-' && port_arg == (char*) 0 )
+            exec_args[nargs++] = port_arg = argv[argn];
+        else
+            usage( argv[0] );
+    }
+    exec_args[nargs] = (char*) 0;
+
+    default_config( &config );
+    if ( config_file != (char*) 0 && read_config( config_file, &config ) < 0 )
+        exit(1);
+    if ( port_arg != (char*) 0 )
+        config.port = atoi( port_arg );
+    port = (u_short) config.port;
 
-    if (argc == 2)
+    if ( upgrade_fd >= 0 )
     {
-        port = (u_short) atoi(argv[1]);
+        /* We're replacing an older process, which hands us its socket. */
+        server_sock = recv_fd( upgrade_fd );
+        if ( server_sock < 0 )
+            error_die("recv_fd");
+        if (getsockname(server_sock, (struct sockaddr *)&client_name, &client_name_len) == -1)
+            error_die("getsockname");
+        port = ntohs(client_name.sin_port);
+        if ( config.port != 0 && config.port != port )
+            (void) fprintf( stderr, "port %d ignored, still listening on %d; changing the port needs a restart\n", config.port, port );
     }
+    else
+        server_sock = startup(&port);
+    config.port = port;
+    (void) fcntl( server_sock, F_SETFD, FD_CLOEXEC );
 
-    server_sock = startup(&port);
+    /* HUP and USR2 stay blocked except while we wait in pselect(), so
+    ** one can't slip in between checking the flags and going to sleep.
+    ** The worker threads inherit the blocked mask.
+    */
+    (void) sigemptyset( &sigs );
+    (void) sigaddset( &sigs, SIGHUP );
+    (void) sigaddset( &sigs, SIGUSR2 );
+    (void) pthread_sigmask( SIG_BLOCK, &sigs, &waitsigs );
+    (void) sigdelset( &waitsigs, SIGHUP );
+    (void) sigdelset( &waitsigs, SIGUSR2 );
+    (void) memset( (void*) &sa, 0, sizeof(sa) );
+    sa.sa_handler = sigflag;
+    (void) sigemptyset( &sa.sa_mask );
+    sa.sa_flags = 0;
+    (void) sigaction( SIGHUP, &sa, (struct sigaction*) 0 );
+    (void) sigaction( SIGUSR2, &sa, (struct sigaction*) 0 );
+
+    /* Non-blocking, so a connection that goes away between pselect()
+    ** and accept() can't leave us stuck in accept().
+    */
+    flags = fcntl( server_sock, F_GETFL );
+    (void) fcntl( server_sock, F_SETFL, flags | O_NONBLOCK );
+
+    if ( upgrade_fd >= 0 )
+    {
+        /* Tell the old process it can stop accepting. */
+        (void) write( upgrade_fd, "R", 1 );
+        (void) close( upgrade_fd );
+    }
     printf("httpd running on port %d\n", port);
 
     while (1)
     {
+        if ( reload_requested )
+        {
+            reload_requested = 0;
+            reload_config();
+        }
+        if ( upgrade_requested )
+        {
+            upgrade_requested = 0;
+            if ( upgrade( server_sock ) == 0 )
+                break;
+        }
+        FD_ZERO( &fdset );
+        FD_SET( server_sock, &fdset );
+        if ( pselect( server_sock + 1, &fdset, (fd_set*) 0, (fd_set*) 0, (struct timespec*) 0, &waitsigs ) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            error_die("pselect");
+        }
+        client_name_len = (unsigned int) sizeof(client_name);
         client_sock = accept(server_sock,
                              (struct sockaddr *)&client_name,
                              &client_name_len);
         if (client_sock == -1)
+        {
+            if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED )
+                continue;
             error_die("accept");
+        }
+        (void) fcntl( client_sock, F_SETFD, FD_CLOEXEC );
+        /* Some systems hand on the listener's O_NONBLOCK. */
+        flags = fcntl( client_sock, F_GETFL );
+        (void) fcntl( client_sock, F_SETFL, flags & ~O_NONBLOCK );
+        (void) pthread_mutex_lock( &active_lock );
+        if ( config.max_connections > 0 && active_connections >= config.max_connections )
+        {
+            (void) pthread_mutex_unlock( &active_lock );
+            send_error( client_sock, 503, "Service Unavailable", (char*) 0, "Too many connections." );
+            close(client_sock);
+            continue;
+        }
+        ++active_connections;
+        (void) pthread_mutex_unlock( &active_lock );
         /* accept_request(client_sock); */
         if (pthread_create(&newthread , NULL, &accept_request, (void *)(long)client_sock) != 0)
+        {
             perror("pthread_create");
+            close(client_sock);
+            (void) pthread_mutex_lock( &active_lock );
+            --active_connections;
+            (void) pthread_mutex_unlock( &active_lock );
+        }
+        else
+            (void) pthread_detach( newthread );
     }
 
+    /* The new process has the socket now; let our requests finish. */
     close(server_sock);
+    drain( config.drain_timeout );
 
     return(0);
 }